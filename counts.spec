@@ -0,0 +1,8 @@
+<number of batches>
+<list of batches, each of them as:
+    <batch name without spaces>
+    <number of transition counts>
+    <state transition counts as space delimited one-per-line triples "from to count"; unmentioned will have zero count>
+    <number of state-symbol emission counts>
+    <state-symbol emission counts as space delimited one-per-line triples "state symbol count"; unmentioned will have zero count>
+>
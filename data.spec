@@ -1,2 +1,4 @@
 <number of step triples, must be larger that zero>
-<list of one-per-line triples "step_number state symbol">
+<list of one-per-line triples "step_number state symbol";
+    for continuous model symbol is replaced with space delimited observation coordinates "value_1 .. value_N"
+>
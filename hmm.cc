@@ -1,8 +1,13 @@
 #include <algorithm>
+#include <cmath>
 #include <vector>
 #include <stdexcept>
 #include <iostream>
+#include <string>
+#include <thread>
+#include <exception>
 #include <cstddef>
+#include <numeric>
 
 #include "hmm.h"
 
@@ -12,6 +17,9 @@ using std::pair;
 
 using HMM::Data::Model;
 using HMM::Data::ExperimentData;
+using HMM::Data::GaussianComponent;
+using HMM::Data::TransitionEmissionCounts;
+using HMM::Data::ViterbiTrainingCounts;
 
 //>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Data namespace definitions >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
 
@@ -31,6 +39,148 @@ namespace
     {
         return symbol[0] - 'a';
     }
+
+    /**
+     * \brief Converts emission symbol index back to a..z ascii character
+     */
+    char indToSymbol(size_t symbolInd)
+    {
+        return static_cast<char> ('a' + symbolInd);
+    }
+
+    /**
+     * \brief Adds (or subtracts) batch counts to the total counts
+     *
+     * \note
+     * Empty total counts are resized to the batch counts dimensions first.
+     */
+    void MergeCounts(TransitionEmissionCounts& total,
+                     const TransitionEmissionCounts& batch, bool subtract)
+    {
+        if (total.transitionCount.empty()) {
+            total.transitionCount.assign(batch.transitionCount.size(),
+                                         vector<size_t> (batch.transitionCount.size(), 0));
+            total.stateSymbolCount.assign(batch.stateSymbolCount.size(),
+                                          vector<size_t> (batch.stateSymbolCount.front().size(), 0));
+        }
+
+        for (size_t i = 0; i < batch.transitionCount.size(); ++i) {
+            for (size_t j = 0; j < batch.transitionCount[i].size(); ++j) {
+                if (subtract) {
+                    total.transitionCount[i][j] -= batch.transitionCount[i][j];
+                } else {
+                    total.transitionCount[i][j] += batch.transitionCount[i][j];
+                }
+            }
+
+            for (size_t j = 0; j < batch.stateSymbolCount[i].size(); ++j) {
+                if (subtract) {
+                    total.stateSymbolCount[i][j] -= batch.stateSymbolCount[i][j];
+                } else {
+                    total.stateSymbolCount[i][j] += batch.stateSymbolCount[i][j];
+                }
+            }
+        }
+    }
+
+    /**
+     * \brief Marks states reachable from the given one through nonzero transitions
+     *
+     * \details
+     * Only states marked as allowed are visited.
+     */
+    vector<bool> MarkReachableStates(size_t fromState, const vector<bool>& allowed,
+                                     const vector<vector<double> >& transitionProb)
+    {
+        size_t nstates = transitionProb.size();
+        vector<bool> reached(nstates, false);
+        vector<size_t> toVisit(1, fromState);
+
+        reached[fromState] = true;
+
+        while (! toVisit.empty()) {
+            size_t curState = toVisit.back();
+            toVisit.pop_back();
+
+            for (size_t nextState = 0; nextState < nstates; ++nextState) {
+                if (transitionProb[curState][nextState] > 0 && allowed[nextState] && ! reached[nextState]) {
+                    reached[nextState] = true;
+                    toVisit.push_back(nextState);
+                }
+            }
+        }
+
+        return reached;
+    }
+
+    /**
+     * \brief Finds reverse Cuthill-McKee order for the given states
+     *
+     * \details
+     * Transitions are treated as undirected edges, so the result reduces
+     * bandwidth of the symmetric nonzero pattern of the transition matrix.
+     * Each connected component is traversed by breadth-first search starting
+     * from its state with minimal degree, neighbours are visited in the order of increasing degree.
+     *
+     * \returns permutation of the given states
+     */
+    vector<size_t> FindReverseCuthillMcKeeOrder(const vector<size_t>& states,
+                                                const vector<vector<double> >& transitionProb)
+    {
+        size_t nstates = states.size();
+        vector<vector<size_t> > neighbours(nstates);
+
+        for (size_t i = 0; i < nstates; ++i) {
+            for (size_t j = 0; j < nstates; ++j) {
+                if (i != j && (transitionProb[states[i]][states[j]] > 0 ||
+                               transitionProb[states[j]][states[i]] > 0)) {
+                    neighbours[i].push_back(j);
+                }
+            }
+        }
+
+        auto lessDegree = [&neighbours](size_t lhs, size_t rhs)
+                          {return neighbours[lhs].size() < neighbours[rhs].size();};
+
+        for (size_t i = 0; i < nstates; ++i) {
+            std::stable_sort(std::begin(neighbours[i]), std::end(neighbours[i]), lessDegree);
+        }
+
+        vector<size_t> byDegree(nstates);
+        vector<bool> visited(nstates, false);
+        vector<size_t> order;
+
+        std::iota(std::begin(byDegree), std::end(byDegree), 0);
+        std::stable_sort(std::begin(byDegree), std::end(byDegree), lessDegree);
+
+        for (size_t startInd : byDegree) {
+            if (visited[startInd]) {
+                continue;
+            }
+
+            // order itself is used as the breadth-first search queue
+            size_t head = order.size();
+            visited[startInd] = true;
+            order.push_back(startInd);
+
+            for (; head < order.size(); ++head) {
+                for (size_t nextInd : neighbours[order[head]]) {
+                    if (! visited[nextInd]) {
+                        visited[nextInd] = true;
+                        order.push_back(nextInd);
+                    }
+                }
+            }
+        }
+
+        vector<size_t> reversedOrder;
+
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            reversedOrder.push_back(states[*it]);
+        }
+
+        return reversedOrder;
+    }
 };
 
 void Model::ReadModel(std::istream& modelSource)
@@ -49,10 +199,38 @@ void Model::ReadModel(std::istream& modelSource)
         modelSource >> stateName;
         stateNameToIndex[stateName] = i;
         stateIndexToName.push_back(stateName);
+        originalStateIndex.push_back(i);
     }
 
-    // section: alphabet reading
-    modelSource >> alphabetSize;
+    // section: alphabet or continuous observation dimension reading
+    string alphabetDescription;
+
+    modelSource >> alphabetDescription;
+
+    if (alphabetDescription == "continuous") {
+        alphabetSize = 0;
+        modelSource >> observationDimension;
+
+        if (observationDimension == 0) {
+            throw std::domain_error("Continuous observations must have at least one coordinate");
+        }
+    } else {
+        size_t parsedLength = 0;
+
+        try
+        {
+            alphabetSize = std::stoul(alphabetDescription, &parsedLength);
+        } catch(std::logic_error&) {
+            parsedLength = 0;
+        }
+
+        if (parsedLength == 0 || parsedLength != alphabetDescription.size()) {
+            throw std::domain_error("Alphabet must be described by the number of symbols "
+                                    "or as 'continuous <number of observation coordinates>'");
+        }
+
+        observationDimension = 0;
+    }
 
     // section: transitions reading
     size_t ntransitions;
@@ -84,21 +262,190 @@ void Model::ReadModel(std::istream& modelSource)
     string symbol; // supposed to be single character, string is used for simpler reading code
 
     stateSymbolProb.assign(nstates, vector<double> (alphabetSize, 0));
+    stateMixtures.assign(nstates, vector<GaussianComponent> ());
     modelSource >> nemissions;
 
     for (size_t i = 0; i < nemissions; ++i) {
-        double prob;
-        modelSource >> stateName >> symbol >> prob;
+        modelSource >> stateName;
 
         size_t stateInd = stateNameToIndex[stateName];
-        size_t symbolInd = symbolToInd(symbol);
 
         if (stateInd == 0 || stateInd + 1 == nstates) {
             throw std::domain_error("Symbol emission from the beginning or the ending states is forbidden");
         }
 
-        stateSymbolProb[stateInd][symbolInd] = prob;
+        if (observationDimension != 0) {
+            // continuous model: mixture component as "weight means variances"
+            GaussianComponent component;
+            component.mean.resize(observationDimension);
+            component.variance.resize(observationDimension);
+
+            modelSource >> component.weight;
+
+            for (double& mean : component.mean) {
+                modelSource >> mean;
+            }
+
+            for (double& variance : component.variance) {
+                modelSource >> variance;
+
+                if (variance <= 0) {
+                    throw std::domain_error("Variance of the gaussian mixture component must be positive");
+                }
+            }
+
+            stateMixtures[stateInd].push_back(component);
+        } else {
+            double prob;
+            modelSource >> symbol >> prob;
+
+            size_t symbolInd = symbolToInd(symbol);
+
+            stateSymbolProb[stateInd][symbolInd] = prob;
+        }
+    }
+}
+
+void Model::Optimize()
+{
+    size_t nstates = transitionProb.size();
+    size_t endState = nstates - 1;
+
+    // section: find states which are able to emit at least one symbol or observation
+    vector<bool> alive(nstates, false);
+
+    alive[0] = true;
+    alive[endState] = true;
+
+    for (size_t state = 1; state < endState; ++state) {
+        alive[state] = (std::any_of(std::begin(stateSymbolProb[state]),
+                                    std::end(stateSymbolProb[state]),
+                                    [](double prob) {return prob > 0;}) ||
+                        std::any_of(std::begin(stateMixtures[state]),
+                                    std::end(stateMixtures[state]),
+                                    [](const GaussianComponent& component)
+                                    {return component.weight > 0;}));
+    }
+
+    // section: keep only states reachable from the beginning state
+    vector<bool> fromBegin = MarkReachableStates(0, alive, transitionProb);
+    vector<size_t> innerStates;
+
+    for (size_t state = 1; state < endState; ++state) {
+        if (fromBegin[state]) {
+            innerStates.push_back(state);
+        } else {
+            prunedStateNames.insert(stateIndexToName[state]);
+        }
+    }
+
+    // section: reorder remaining states, the beginning and the ending ones stay in place
+    vector<size_t> newToOld = FindReverseCuthillMcKeeOrder(innerStates, transitionProb);
+
+    newToOld.insert(std::begin(newToOld), 0);
+    newToOld.push_back(endState);
+
+    // section: rebuild model data according to the new order
+    size_t newStates = newToOld.size();
+    vector<vector<double> > newTransitionProb(newStates, vector<double> (newStates, 0));
+    vector<vector<double> > newStateSymbolProb(newStates);
+    vector<vector<GaussianComponent> > newStateMixtures(newStates);
+    vector<string> newStateIndexToName(newStates);
+    vector<size_t> newOriginalStateIndex(newStates);
+
+    stateNameToIndex.clear();
+
+    for (size_t i = 0; i < newStates; ++i) {
+        for (size_t j = 0; j < newStates; ++j) {
+            newTransitionProb[i][j] = transitionProb[newToOld[i]][newToOld[j]];
+        }
+
+        newStateSymbolProb[i] = stateSymbolProb[newToOld[i]];
+        newStateMixtures[i] = stateMixtures[newToOld[i]];
+        newStateIndexToName[i] = stateIndexToName[newToOld[i]];
+        newOriginalStateIndex[i] = originalStateIndex[newToOld[i]];
+        stateNameToIndex[newStateIndexToName[i]] = i;
+    }
+
+    transitionProb.swap(newTransitionProb);
+    stateSymbolProb.swap(newStateSymbolProb);
+    stateMixtures.swap(newStateMixtures);
+    stateIndexToName.swap(newStateIndexToName);
+    originalStateIndex.swap(newOriginalStateIndex);
+}
+
+void Model::WriteModel(std::ostream& modelDestination) const
+{
+    size_t nstates = transitionProb.size();
+    std::streamsize oldPrecision = modelDestination.precision(10);
+
+    // section: states and alphabet writing
+    modelDestination << nstates << '\n';
+
+    for (size_t i = 0; i < nstates; ++i) {
+        modelDestination << stateIndexToName[i] << (i + 1 == nstates ? '\n' : ' ');
+    }
+
+    if (observationDimension != 0) {
+        modelDestination << "continuous " << observationDimension << '\n';
+    } else {
+        modelDestination << alphabetSize << '\n';
+    }
+
+    // section: nonzero transitions writing
+    size_t ntransitions = 0;
+
+    for (const vector<double>& row : transitionProb) {
+        ntransitions += std::count_if(std::begin(row), std::end(row),
+                                      [](double prob) {return prob != 0;});
+    }
+
+    modelDestination << ntransitions << '\n';
+
+    for (size_t i = 0; i < nstates; ++i) {
+        for (size_t j = 0; j < nstates; ++j) {
+            if (transitionProb[i][j] != 0) {
+                modelDestination << stateIndexToName[i] << ' ' << stateIndexToName[j] << ' '
+                                 << transitionProb[i][j] << '\n';
+            }
+        }
+    }
+
+    // section: nonzero emissions or mixture components writing
+    size_t nemissions = 0;
+
+    for (size_t i = 0; i < nstates; ++i) {
+        nemissions += stateMixtures[i].size();
+        nemissions += std::count_if(std::begin(stateSymbolProb[i]), std::end(stateSymbolProb[i]),
+                                    [](double prob) {return prob != 0;});
+    }
+
+    modelDestination << nemissions << '\n';
+
+    for (size_t i = 0; i < nstates; ++i) {
+        for (const GaussianComponent& component : stateMixtures[i]) {
+            modelDestination << stateIndexToName[i] << ' ' << component.weight;
+
+            for (double mean : component.mean) {
+                modelDestination << ' ' << mean;
+            }
+
+            for (double variance : component.variance) {
+                modelDestination << ' ' << variance;
+            }
+
+            modelDestination << '\n';
+        }
+
+        for (size_t j = 0; j < stateSymbolProb[i].size(); ++j) {
+            if (stateSymbolProb[i][j] != 0) {
+                modelDestination << stateIndexToName[i] << ' ' << indToSymbol(j) << ' '
+                                 << stateSymbolProb[i][j] << '\n';
+            }
+        }
     }
+
+    modelDestination.precision(oldPrecision);
 }
 
 void ExperimentData::ReadExperimentData(const Model& model, std::istream& dataSource)
@@ -115,19 +462,147 @@ void ExperimentData::ReadExperimentData(const Model& model, std::istream& dataSo
     }
 
     for (size_t i = 0; i < nsteps; ++i) {
-        dataSource >> stepNumber >> stateName >> symbol;
+        dataSource >> stepNumber >> stateName;
+
+        bool pruned = (model.prunedStateNames.count(stateName) != 0);
+        size_t stateInd = (pruned ? 0 : model.stateNameToIndex.at(stateName));
+
+        realStatePruned.push_back(pruned);
+
+        if (model.observationDimension != 0) {
+            vector<double> observation(model.observationDimension);
+
+            for (double& value : observation) {
+                dataSource >> value;
+            }
+
+            observations.push_back(std::move(observation));
+            timeStateSymbol.emplace_back(stepNumber, stateInd, 0);
+        } else {
+            dataSource >> symbol;
 
-        size_t stateInd = model.stateNameToIndex.at(stateName);
-        size_t symbolInd = symbolToInd(symbol);
+            size_t symbolInd = symbolToInd(symbol);
 
-        timeStateSymbol.emplace_back(stepNumber, stateInd, symbolInd);
+            timeStateSymbol.emplace_back(stepNumber, stateInd, symbolInd);
+        }
+    }
+}
+
+void ViterbiTrainingCounts::ReadCounts(const Model& model, std::istream& countsSource)
+{
+    size_t nstates = model.transitionProb.size();
+    size_t nbatches;
+    string batchName;
+    string stateName;
+    string targetStateName;
+    string symbol; // supposed to be single character, string is used for simpler reading code
+
+    countsSource >> nbatches;
+
+    for (size_t i = 0; i < nbatches; ++i) {
+        TransitionEmissionCounts counts;
+        size_t ntransitions;
+        size_t nemissions;
+
+        counts.transitionCount.assign(nstates, vector<size_t> (nstates, 0));
+        counts.stateSymbolCount.assign(nstates, vector<size_t> (model.alphabetSize, 0));
+        countsSource >> batchName >> ntransitions;
+
+        for (size_t j = 0; j < ntransitions; ++j) {
+            size_t count;
+            countsSource >> stateName >> targetStateName >> count;
+
+            counts.transitionCount[model.stateNameToIndex.at(stateName)]
+                                  [model.stateNameToIndex.at(targetStateName)] = count;
+        }
+
+        countsSource >> nemissions;
+
+        for (size_t j = 0; j < nemissions; ++j) {
+            size_t count;
+            countsSource >> stateName >> symbol >> count;
+
+            size_t symbolInd = symbolToInd(symbol);
+
+            if (symbolInd >= model.alphabetSize) {
+                throw std::domain_error("Counted symbol is out of the model alphabet");
+            }
+
+            counts.stateSymbolCount[model.stateNameToIndex.at(stateName)][symbolInd] = count;
+        }
+
+        AddBatch(batchName, counts);
+    }
+}
+
+void ViterbiTrainingCounts::WriteCounts(const Model& model, std::ostream& countsDestination) const
+{
+    countsDestination << batchCounts.size() << '\n';
+
+    for (const auto& batch : batchCounts) {
+        const TransitionEmissionCounts& counts = batch.second;
+        size_t ntransitions = 0;
+        size_t nemissions = 0;
+
+        for (size_t i = 0; i < counts.transitionCount.size(); ++i) {
+            ntransitions += counts.transitionCount[i].size() -
+                std::count(std::begin(counts.transitionCount[i]), std::end(counts.transitionCount[i]), 0);
+            nemissions += counts.stateSymbolCount[i].size() -
+                std::count(std::begin(counts.stateSymbolCount[i]), std::end(counts.stateSymbolCount[i]), 0);
+        }
+
+        countsDestination << batch.first << '\n' << ntransitions << '\n';
+
+        for (size_t i = 0; i < counts.transitionCount.size(); ++i) {
+            for (size_t j = 0; j < counts.transitionCount[i].size(); ++j) {
+                if (counts.transitionCount[i][j] != 0) {
+                    countsDestination << model.stateIndexToName[i] << ' '
+                                      << model.stateIndexToName[j] << ' '
+                                      << counts.transitionCount[i][j] << '\n';
+                }
+            }
+        }
+
+        countsDestination << nemissions << '\n';
+
+        for (size_t i = 0; i < counts.stateSymbolCount.size(); ++i) {
+            for (size_t j = 0; j < counts.stateSymbolCount[i].size(); ++j) {
+                if (counts.stateSymbolCount[i][j] != 0) {
+                    countsDestination << model.stateIndexToName[i] << ' ' << indToSymbol(j) << ' '
+                                      << counts.stateSymbolCount[i][j] << '\n';
+                }
+            }
+        }
     }
 }
+
+void ViterbiTrainingCounts::AddBatch(const string& batchName, const TransitionEmissionCounts& counts)
+{
+    if (batchCounts.count(batchName) != 0) {
+        RemoveBatch(batchName);
+    }
+
+    MergeCounts(totalCounts, counts, false);
+    batchCounts[batchName] = counts;
+}
+
+void ViterbiTrainingCounts::RemoveBatch(const string& batchName)
+{
+    auto batch = batchCounts.find(batchName);
+
+    if (batch == batchCounts.end()) {
+        throw std::out_of_range("There is no training batch with name '" + batchName + "'");
+    }
+
+    MergeCounts(totalCounts, batch->second, true);
+    batchCounts.erase(batch);
+}
 //<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< end of Data namespace definitions <<<<<<<<<<<<<<<<<<<<<<<<<<
 
 
 //>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Algorithms namespace definitions >>>>>>>>>>>>>>>>>>>>>>>>>>
 const size_t HMM_UNDEFINED_STATE = -1;
+const size_t HMM_EMISSION_BLOCK_SIZE = 256;
 
 /**
  * \note
@@ -135,11 +610,86 @@ const size_t HMM_UNDEFINED_STATE = -1;
  */
 namespace
 {
+    /**
+     * \brief Aux. function to check whether the state with the given value is better than the current best one
+     *
+     * \details
+     * Ties are broken by the state index in the model description file, so state
+     * reordering by Model::Optimize does not change the results.
+     */
+    bool IsBetterState(double value, size_t state, double bestValue, size_t bestState,
+                       const Model& model)
+    {
+        return (value > bestValue ||
+                (value == bestValue &&
+                 model.originalStateIndex[state] < model.originalStateIndex[bestState]));
+    }
+
+    /**
+     * \brief Aux. function to find the state with the maximal value, see IsBetterState for ties
+     */
+    size_t FindBestState(const vector<double>& stateValues, const Model& model)
+    {
+        size_t bestState = 0;
+
+        for (size_t state = 1; state < stateValues.size(); ++state) {
+            if (IsBetterState(stateValues[state], state,
+                              stateValues[bestState], bestState, model)) {
+                bestState = state;
+            }
+        }
+
+        return bestState;
+    }
+
+    /**
+     * \note
+     * element[j] is the list of states with nonzero transitions to (or from) the j-th state.
+     */
+    typedef vector<vector<size_t> > TransitionLists;
+
+    /**
+     * \brief Aux. function to collect nonzero transitions of each state
+     *
+     * \details
+     * Algorithm steps walk over these lists instead of all states, so they touch only
+     * nearby states of the model reordered by Model::Optimize. Lists are sorted by
+     * originalStateIndex, so sums over them are accumulated in the same order as
+     * for the model before reordering and the results stay the same.
+     *
+     * \returns lists of transition sources for each state if incoming is set,
+     *          lists of transition targets otherwise
+     */
+    TransitionLists CollectTransitions(const Model& model, bool incoming)
+    {
+        size_t nstates = model.transitionProb.size();
+        vector<size_t> byOriginalIndex(nstates);
+        TransitionLists transitions(nstates);
+
+        std::iota(std::begin(byOriginalIndex), std::end(byOriginalIndex), 0);
+        std::sort(std::begin(byOriginalIndex), std::end(byOriginalIndex),
+                  [&model](size_t lhs, size_t rhs)
+                  {return model.originalStateIndex[lhs] < model.originalStateIndex[rhs];});
+
+        for (size_t state = 0; state < nstates; ++state) {
+            for (size_t otherState : byOriginalIndex) {
+                if (incoming && model.transitionProb[otherState][state] != 0) {
+                    transitions[state].push_back(otherState);
+                } else if (! incoming && model.transitionProb[state][otherState] != 0) {
+                    transitions[state].push_back(otherState);
+                }
+            }
+        }
+
+        return transitions;
+    }
+
     /**
      * \brief Aux. function to calculate new state probability for the Viterbi algorithm step
      */
     double CalcNewStateProbability(size_t stepNumber, size_t prevState,
-                                   size_t curState, size_t curSymbol, const Model& model,
+                                   size_t curState, const Model& model,
+                                   const vector<vector<double> >& emissionProbability,
                                    const vector<vector<double> >& sequenceProbability)
     {
         double prevProbability = 1.;
@@ -154,36 +704,40 @@ namespace
 
         return (prevProbability *
                 model.transitionProb[prevState][curState] *
-                model.stateSymbolProb[curState][curSymbol]);
+                emissionProbability[stepNumber][curState]);
     }
 
     /**
      * \brief Aux. function to find the best previous state during the Viterbi algorithm step
+     *
+     * \details
+     * Only states with nonzero transitions to the current one are checked, all the others
+     * give zero probability. The starting state is the initial candidate, so it is the result
+     * when all probabilities are zero, as it would be for the check of all states.
      */
-    size_t FindBestTransitionSource(size_t stepNumber, size_t curState,
-                                    size_t curSymbol, const Model& model,
+    size_t FindBestTransitionSource(size_t stepNumber, size_t curState, const Model& model,
+                                    const TransitionLists& transitionSources,
+                                    const vector<vector<double> >& emissionProbability,
                                     const vector<vector<double> >& sequenceProbability)
     {
         if (stepNumber == 0) {
             return 0;
         }
 
-        size_t nstates = model.transitionProb.size();
-        double bestProbValue = -1;
-        size_t bestPrevState = HMM_UNDEFINED_STATE;
+        size_t bestPrevState = 0;
+        double bestProbValue = CalcNewStateProbability(stepNumber, bestPrevState, curState, model,
+                                                       emissionProbability, sequenceProbability);
 
-        for (size_t prevState = 0; prevState < nstates; ++prevState) {
-            double curProb = CalcNewStateProbability(stepNumber, prevState,
-                                                     curState, curSymbol,
-                                                     model, sequenceProbability);
+        for (size_t prevState : transitionSources[curState]) {
+            double curProb = CalcNewStateProbability(stepNumber, prevState, curState, model,
+                                                     emissionProbability, sequenceProbability);
 
-            if (curProb > bestProbValue) {
+            if (IsBetterState(curProb, prevState, bestProbValue, bestPrevState, model)) {
                 bestProbValue = curProb;
                 bestPrevState = prevState;
             }
         }
 
-        // there must be at least two states => the result won't be undefined
         return bestPrevState;
     }
 
@@ -193,24 +747,22 @@ namespace
      * \details
      * This is used inside forward-backward algorithm at forward probabilities calculation.
      */
-    double CalcForwardStepProbability(size_t stepNumber, size_t curState,
-                                      const Model& model, const ExperimentData& data,
+    double CalcForwardStepProbability(size_t stepNumber, size_t curState, const Model& model,
+                                      const TransitionLists& transitionSources,
+                                      const vector<vector<double> >& emissionProbability,
                                       const vector<vector<double> >& forwardStateProbability)
     {
-        size_t nstates = model.transitionProb.size();
-        size_t curSymbol = std::get<2> (data.timeStateSymbol[stepNumber]);
-
         if (stepNumber == 0) {
-            return model.transitionProb[0][curState] * model.stateSymbolProb[curState][curSymbol];
+            return model.transitionProb[0][curState] * emissionProbability[stepNumber][curState];
         } else {
             double prevCumulativeProb = 0;
 
-            for (size_t prevState = 0; prevState < nstates; ++prevState) {
+            for (size_t prevState : transitionSources[curState]) {
                 prevCumulativeProb += (forwardStateProbability[stepNumber - 1][prevState] *
                                        model.transitionProb[prevState][curState]);
             }
 
-            return prevCumulativeProb * model.stateSymbolProb[curState][curSymbol];
+            return prevCumulativeProb * emissionProbability[stepNumber][curState];
         }
     }
 
@@ -220,30 +772,307 @@ namespace
      * \details
      * This is used inside forward-backward algorithm at backward probabilities calculation.
      */
-    double CalcBackwardStepProbability(size_t stepNumber, size_t curState,
-                                       const Model& model, const ExperimentData& data,
+    double CalcBackwardStepProbability(size_t stepNumber, size_t curState, const Model& model,
+                                       const TransitionLists& transitionTargets,
+                                       const vector<vector<double> >& emissionProbability,
                                        const vector<vector<double> >& backwardStateProbability)
     {
-        size_t nstates = model.transitionProb.size();
-        size_t maxtime = data.timeStateSymbol.size();
+        size_t maxtime = emissionProbability.size();
 
         if (stepNumber + 1 == maxtime) {
             return 1.; // probability to describe empty sequence is 1.
         } else {
-            size_t nextSymbol = std::get<2> (data.timeStateSymbol[stepNumber + 1]);
             double nextCumulativeProb = 0.;
 
-            for (size_t nextState = 0; nextState < nstates; ++nextState) {
+            for (size_t nextState : transitionTargets[curState]) {
                 nextCumulativeProb += (model.transitionProb[curState][nextState] *
-                                       model.stateSymbolProb[nextState][nextSymbol] *
+                                       emissionProbability[stepNumber + 1][nextState] *
                                        backwardStateProbability[stepNumber + 1][nextState]);
             }
 
             return nextCumulativeProb;
         }
     }
+
+    /**
+     * \brief Auxiliary buffers for the gaussian mixture kernel, reused between blocks and states
+     */
+    struct MixtureWorkspace
+    {
+        /// element[k][b] is the log-likelihood of b-th observation for k-th component
+        vector<vector<double> > componentLogLikelihood;
+
+        /// element[b] is the sum of exponents for b-th observation
+        vector<double> expSum;
+    };
+
+    /**
+     * \brief Aux. function to calculate log-likelihoods of the gaussian mixture for the block of observations
+     *
+     * \details
+     * Observations are passed coordinate by coordinate: transposedObservations[d][b] is
+     * the d-th coordinate of the b-th observation of the block. Thus inner loops walk over
+     * contiguous arrays without branches, so the compiler is able to vectorize them.
+     * Infinities are never produced, so the kernel stays correct with -ffast-math,
+     * which is required for vectorization of the exp and log loops.
+     *
+     * \returns false if the mixture has no components with positive weight, logLikelihood is not set then
+     */
+    bool CalcMixtureLogLikelihoods(const vector<GaussianComponent>& mixture,
+                                   const vector<vector<double> >& transposedObservations,
+                                   size_t blockSize, MixtureWorkspace& workspace,
+                                   vector<double>& logLikelihood)
+    {
+        const double logTwoPi = std::log(2. * std::acos(-1.));
+        size_t ncomponents = 0;
+
+        // section: calculate log-likelihoods of each component with nonzero weight
+        for (const GaussianComponent& component : mixture) {
+            if (component.weight <= 0) {
+                continue;
+            }
+
+            if (workspace.componentLogLikelihood.size() == ncomponents) {
+                workspace.componentLogLikelihood.emplace_back();
+            }
+
+            vector<double>& componentResult = workspace.componentLogLikelihood[ncomponents++];
+            componentResult.assign(blockSize, 0.);
+
+            double* distance = componentResult.data();
+            double logNormalization = std::log(component.weight);
+
+            for (size_t d = 0; d < transposedObservations.size(); ++d) {
+                const double* values = transposedObservations[d].data();
+                double mean = component.mean[d];
+                double inverseVariance = 1. / component.variance[d];
+
+                logNormalization -= 0.5 * (logTwoPi + std::log(component.variance[d]));
+
+                for (size_t b = 0; b < blockSize; ++b) {
+                    double diff = values[b] - mean;
+                    distance[b] += diff * diff * inverseVariance;
+                }
+            }
+
+            for (size_t b = 0; b < blockSize; ++b) {
+                distance[b] = logNormalization - 0.5 * distance[b];
+            }
+        }
+
+        if (ncomponents == 0) {
+            return false;
+        }
+
+        // section: combine components with log-sum-exp
+        logLikelihood.assign(std::begin(workspace.componentLogLikelihood[0]),
+                             std::begin(workspace.componentLogLikelihood[0]) + blockSize);
+
+        if (ncomponents == 1) {
+            return true;
+        }
+
+        workspace.expSum.assign(blockSize, 0.);
+
+        double* result = logLikelihood.data();
+        double* expSum = workspace.expSum.data();
+
+        for (size_t k = 1; k < ncomponents; ++k) {
+            const double* values = workspace.componentLogLikelihood[k].data();
+
+            for (size_t b = 0; b < blockSize; ++b) {
+                result[b] = std::max(result[b], values[b]);
+            }
+        }
+
+        for (size_t k = 0; k < ncomponents; ++k) {
+            const double* values = workspace.componentLogLikelihood[k].data();
+
+            for (size_t b = 0; b < blockSize; ++b) {
+                expSum[b] += std::exp(values[b] - result[b]);
+            }
+        }
+
+        for (size_t b = 0; b < blockSize; ++b) {
+            result[b] += std::log(expSum[b]);
+        }
+
+        return true;
+    }
+
+    /**
+     * \brief Aux. function to scale probabilities so that they sum to one
+     *
+     * \note
+     * Vector of zeros is left as is.
+     */
+    void NormalizeProbabilities(vector<double>& prob)
+    {
+        double total = std::accumulate(std::begin(prob), std::end(prob), 0.);
+
+        if (total > 0) {
+            for (double& value : prob) {
+                value /= total;
+            }
+        }
+    }
+
+    /**
+     * \brief Aux. function to get scaled forward probabilities of the next step
+     *
+     * \details
+     * This is used for checkpointed posterior calculation. Forward probabilities
+     * of the very first step are obtained from the vector with the only nonzero value at the starting state.
+     */
+    vector<double> CalcScaledForwardStep(const vector<double>& prevForward,
+                                         const vector<double>& curEmission, const Model& model,
+                                         const TransitionLists& transitionSources)
+    {
+        size_t nstates = model.transitionProb.size();
+        vector<double> curForward(nstates, 0.);
+
+        for (size_t curState = 0; curState < nstates; ++curState) {
+            for (size_t prevState : transitionSources[curState]) {
+                curForward[curState] += (prevForward[prevState] *
+                                         model.transitionProb[prevState][curState]);
+            }
+
+            curForward[curState] *= curEmission[curState];
+        }
+
+        NormalizeProbabilities(curForward);
+
+        return curForward;
+    }
+
+    /**
+     * \brief Aux. function to get scaled backward probabilities of the previous step
+     *
+     * \details
+     * This is used for checkpointed posterior calculation.
+     */
+    vector<double> CalcScaledBackwardStep(const vector<double>& nextBackward,
+                                          const vector<double>& nextEmission, const Model& model,
+                                          const TransitionLists& transitionTargets)
+    {
+        size_t nstates = model.transitionProb.size();
+        vector<double> weightedNext(nstates);
+        vector<double> curBackward(nstates, 0.);
+
+        for (size_t nextState = 0; nextState < nstates; ++nextState) {
+            weightedNext[nextState] = nextEmission[nextState] * nextBackward[nextState];
+        }
+
+        for (size_t curState = 0; curState < nstates; ++curState) {
+            for (size_t nextState : transitionTargets[curState]) {
+                curBackward[curState] += (model.transitionProb[curState][nextState] *
+                                          weightedNext[nextState]);
+            }
+        }
+
+        NormalizeProbabilities(curBackward);
+
+        return curBackward;
+    }
 };
 
+vector<vector<double> >
+HMM::Algorithms::CalcEmissionProbabilities(const Model& model, const ExperimentData& data,
+                                           size_t first, size_t last)
+{
+    if (first > last || last >= data.timeStateSymbol.size()) {
+        throw std::out_of_range("Emission block is out of the experiment data range");
+    }
+
+    size_t nstates = model.transitionProb.size();
+    vector<vector<double> > emissionProbability(last - first + 1, vector<double> (nstates, 0.));
+
+    // section: discrete model, just take symbol emission probabilities
+    if (model.observationDimension == 0) {
+        for (size_t t = first; t <= last; ++t) {
+            size_t curSymbol = std::get<2> (data.timeStateSymbol[t]);
+
+            for (size_t state = 0; state < nstates; ++state) {
+                emissionProbability[t - first][state] = model.stateSymbolProb[state][curSymbol];
+            }
+        }
+
+        return emissionProbability;
+    }
+
+    // section: continuous model, calculate mixture log-likelihoods block by block
+    if (data.observations.size() != data.timeStateSymbol.size()) {
+        throw std::domain_error("Experiment data has no real-valued observations for the continuous model");
+    }
+
+    vector<vector<double> > transposedObservations(model.observationDimension);
+    vector<vector<double> > stateLogLikelihood(nstates);
+    vector<bool> stateEmits(nstates);
+    vector<double> maxLogLikelihood;
+    vector<double> shiftedExp;
+    MixtureWorkspace workspace;
+
+    for (size_t blockFirst = first; blockFirst <= last; blockFirst += HMM_EMISSION_BLOCK_SIZE) {
+        size_t blockSize = std::min(HMM_EMISSION_BLOCK_SIZE, last - blockFirst + 1);
+        bool anyStateEmits = false;
+
+        for (size_t d = 0; d < model.observationDimension; ++d) {
+            transposedObservations[d].resize(blockSize);
+
+            for (size_t b = 0; b < blockSize; ++b) {
+                transposedObservations[d][b] = data.observations[blockFirst + b][d];
+            }
+        }
+
+        // section: log-likelihoods and their maximum at each time moment over emitting states
+        for (size_t state = 0; state < nstates; ++state) {
+            stateEmits[state] = CalcMixtureLogLikelihoods(model.stateMixtures[state],
+                                                          transposedObservations, blockSize,
+                                                          workspace, stateLogLikelihood[state]);
+
+            if (! stateEmits[state]) {
+                continue;
+            }
+
+            const double* values = stateLogLikelihood[state].data();
+
+            if (! anyStateEmits) {
+                maxLogLikelihood.assign(values, values + blockSize);
+                anyStateEmits = true;
+            } else {
+                double* maxValues = maxLogLikelihood.data();
+
+                for (size_t b = 0; b < blockSize; ++b) {
+                    maxValues[b] = std::max(maxValues[b], values[b]);
+                }
+            }
+        }
+
+        // section: shift by the maximum to avoid underflow and exponentiate, states without emissions keep zero
+        shiftedExp.resize(blockSize);
+
+        for (size_t state = 0; state < nstates; ++state) {
+            if (! stateEmits[state]) {
+                continue;
+            }
+
+            const double* values = stateLogLikelihood[state].data();
+            const double* maxValues = maxLogLikelihood.data();
+            double* expValues = shiftedExp.data();
+
+            for (size_t b = 0; b < blockSize; ++b) {
+                expValues[b] = std::exp(values[b] - maxValues[b]);
+            }
+
+            for (size_t b = 0; b < blockSize; ++b) {
+                emissionProbability[blockFirst - first + b][state] = expValues[b];
+            }
+        }
+    }
+
+    return emissionProbability;
+}
+
 vector<size_t>
 HMM::Algorithms::FindMostProbableStateSequence(const Model& model, const ExperimentData& data)
 {
@@ -254,7 +1083,9 @@ HMM::Algorithms::FindMostProbableStateSequence(const Model& model, const Experim
     /**
      * \note
      * sequenceProbability[i][j] is the probability of the most probable sequence of states
-     * for 1..i observations for which the last state is j-th
+     * for 1..i observations for which the last state is j-th.
+     * Probabilities of each step are divided by their maximum to avoid underflow on long data,
+     * it does not change the most probable sequence.
      */
     vector<vector<double> > sequenceProbability(maxtime,
                                                 vector<double> (nstates, 0));
@@ -269,20 +1100,33 @@ HMM::Algorithms::FindMostProbableStateSequence(const Model& model, const Experim
     vector<vector<size_t> > prevSeqState(maxtime,
                                          vector<size_t> (nstates, HMM_UNDEFINED_STATE));
 
+    vector<vector<double> > emissionProbability =
+        CalcEmissionProbabilities(model, data, 0, maxtime - 1);
+    TransitionLists transitionSources = CollectTransitions(model, true);
+
     // section: calculate probabilities for Viterbi algorithm using dynamic programming approach
     for (size_t t = 0; t < maxtime; ++t) {
         for (size_t curState = 0; curState < nstates; ++curState) {
-            size_t curSymbol = std::get<2> (data.timeStateSymbol[t]);
-            size_t bestPrevState = FindBestTransitionSource(t, curState,
-                                                            curSymbol, model,
+            size_t bestPrevState = FindBestTransitionSource(t, curState, model,
+                                                            transitionSources,
+                                                            emissionProbability,
                                                             sequenceProbability);
-            double bestProbValue = CalcNewStateProbability(t, bestPrevState,
-                                                           curState, curSymbol,
-                                                           model, sequenceProbability);
+            double bestProbValue = CalcNewStateProbability(t, bestPrevState, curState, model,
+                                                           emissionProbability,
+                                                           sequenceProbability);
 
             sequenceProbability[t][curState] = bestProbValue;
             prevSeqState[t][curState] = bestPrevState;
         }
+
+        double maxProbValue = *std::max_element(std::begin(sequenceProbability[t]),
+                                                std::end(sequenceProbability[t]));
+
+        if (maxProbValue > 0) {
+            for (double& probValue : sequenceProbability[t]) {
+                probValue /= maxProbValue;
+            }
+        }
     }
 
     // section: collect most probable sequence in the reverse order
@@ -290,9 +1134,7 @@ HMM::Algorithms::FindMostProbableStateSequence(const Model& model, const Experim
     ptrdiff_t curStep = maxtime - 1;
 
     // find the last state of the most probable sequence to start recovery from it
-    size_t curState = std::distance(std::begin(sequenceProbability[curStep]),
-                                    std::max_element(std::begin(sequenceProbability[curStep]),
-                                                     std::end(sequenceProbability[curStep])));
+    size_t curState = FindBestState(sequenceProbability[curStep], model);
 
     for (; curStep > 0; --curStep) {
         curState = prevSeqState[curStep][curState];
@@ -320,11 +1162,17 @@ HMM::Algorithms::CalcForwardBackwardProbabiliies(const Model& model, const Exper
      */
     vector<vector<double> > forwardStateProbability(maxtime, vector<double> (nstates, 0));
 
+    vector<vector<double> > emissionProbability =
+        CalcEmissionProbabilities(model, data, 0, maxtime - 1);
+    TransitionLists transitionSources = CollectTransitions(model, true);
+    TransitionLists transitionTargets = CollectTransitions(model, false);
+
     // section: calculate forward probabilities of the forward-backward algorithm
     for (size_t t = 0; t < maxtime; ++t) {
         for (size_t curState = 0; curState < nstates; ++curState) {
             double cumulativePrevProbability =
-                CalcForwardStepProbability(t, curState, model, data, forwardStateProbability);
+                CalcForwardStepProbability(t, curState, model, transitionSources,
+                                           emissionProbability, forwardStateProbability);
 
             forwardStateProbability[t][curState] = cumulativePrevProbability;
         }
@@ -341,7 +1189,8 @@ HMM::Algorithms::CalcForwardBackwardProbabiliies(const Model& model, const Exper
     for (ptrdiff_t t = maxtime - 1; t >= 0; --t) {
         for (size_t curState = 0; curState < nstates; ++curState) {
             double cumulativeNextProbability =
-                CalcBackwardStepProbability(t, curState, model, data, backwardStateProbability);
+                CalcBackwardStepProbability(t, curState, model, transitionTargets,
+                                            emissionProbability, backwardStateProbability);
 
             backwardStateProbability[t][curState] = cumulativeNextProbability;
         }
@@ -361,26 +1210,301 @@ HMM::Algorithms::CalcForwardBackwardProbabiliies(const Model& model, const Exper
 
     return std::move(forwardBackwardProbability);
 }
+
+TransitionEmissionCounts
+HMM::Algorithms::CountMostProbableStateSequences(const Model& model,
+                                                 const vector<ExperimentData>& sequences,
+                                                 size_t nthreads)
+{
+    if (model.observationDimension != 0) {
+        throw std::domain_error("Viterbi training supports only discrete models");
+    }
+
+    size_t nstates = model.transitionProb.size();
+    size_t endState = nstates - 1;
+
+    nthreads = std::max<size_t> (1, std::min(nthreads, sequences.size()));
+
+    TransitionEmissionCounts emptyCounts;
+    emptyCounts.transitionCount.assign(nstates, vector<size_t> (nstates, 0));
+    emptyCounts.stateSymbolCount.assign(nstates, vector<size_t> (model.alphabetSize, 0));
+
+    // section: decode sequences in parallel, each thread takes every nthreads-th sequence
+    vector<TransitionEmissionCounts> threadCounts(nthreads, emptyCounts);
+    vector<std::exception_ptr> threadErrors(nthreads);
+    vector<std::thread> workers;
+
+    auto countSequences = [&](size_t threadInd)
+    {
+        TransitionEmissionCounts& counts = threadCounts[threadInd];
+
+        try
+        {
+            for (size_t i = threadInd; i < sequences.size(); i += nthreads) {
+                vector<size_t> stateSeq = FindMostProbableStateSequence(model, sequences[i]);
+                size_t prevState = 0;
+
+                for (size_t t = 0; t < stateSeq.size(); ++t) {
+                    size_t curState = stateSeq[t];
+                    size_t curSymbol = std::get<2> (sequences[i].timeStateSymbol[t]);
+
+                    if (model.transitionProb[prevState][curState] == 0 ||
+                        model.stateSymbolProb[curState][curSymbol] == 0) {
+                        throw std::domain_error("Training sequence " + std::to_string(i) +
+                                                " has no hidden state sequence with nonzero probability");
+                    }
+
+                    if (curState == 0 || curState == endState) {
+                        throw std::logic_error("Transition to the starting state or emission from "
+                                               "the beginning or the ending states has been counted");
+                    }
+
+                    ++counts.transitionCount[prevState][curState];
+                    ++counts.stateSymbolCount[curState][curSymbol];
+                    prevState = curState;
+                }
+
+                // the decoder does not look at the ending state, so count only transitions the model allows
+                if (model.transitionProb[prevState][endState] != 0) {
+                    ++counts.transitionCount[prevState][endState];
+                }
+            }
+        } catch(...) {
+            threadErrors[threadInd] = std::current_exception();
+        }
+    };
+
+    for (size_t threadInd = 1; threadInd < nthreads; ++threadInd) {
+        workers.emplace_back(countSequences, threadInd);
+    }
+
+    countSequences(0);
+
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    for (const std::exception_ptr& error : threadErrors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // section: sum counts of all threads
+    TransitionEmissionCounts totalCounts = emptyCounts;
+
+    for (const TransitionEmissionCounts& counts : threadCounts) {
+        MergeCounts(totalCounts, counts, false);
+    }
+
+    return totalCounts;
+}
+
+Model HMM::Algorithms::TrainModel(const Model& model, const ViterbiTrainingCounts& counts,
+                                  double priorWeight)
+{
+    Model trainedModel = model;
+    const TransitionEmissionCounts& total = counts.totalCounts;
+
+    if (total.transitionCount.empty()) {
+        return trainedModel; // nothing has been counted yet
+    }
+
+    /**
+     * \note
+     * Aux. function to mix one row of counts with the prior probabilities row.
+     */
+    auto mixRow = [priorWeight](const vector<size_t>& countRow, vector<double>& probRow)
+    {
+        double countTotal = std::accumulate(std::begin(countRow), std::end(countRow), 0.);
+        double priorTotal = std::accumulate(std::begin(probRow), std::end(probRow), 0.);
+        double denominator = countTotal + priorWeight * priorTotal;
+
+        if (denominator <= 0) {
+            return; // neither counts nor prior
+        }
+
+        for (size_t j = 0; j < probRow.size(); ++j) {
+            probRow[j] = ((static_cast<double> (countRow[j]) + priorWeight * probRow[j]) /
+                          denominator);
+        }
+    };
+
+    for (size_t i = 0; i < trainedModel.transitionProb.size(); ++i) {
+        mixRow(total.transitionCount[i], trainedModel.transitionProb[i]);
+        mixRow(total.stateSymbolCount[i], trainedModel.stateSymbolProb[i]);
+    }
+
+    return trainedModel;
+}
+
+HMM::Algorithms::PosteriorIndex::PosteriorIndex(const Model& model, const ExperimentData& data,
+                                                size_t checkpointStep, size_t cacheSize)
+    : model(model), data(data), checkpointStep(checkpointStep), cacheSize(cacheSize),
+      transitionSources(CollectTransitions(model, true)),
+      transitionTargets(CollectTransitions(model, false))
+{
+    if (checkpointStep == 0) {
+        throw std::domain_error("Checkpoint step must be positive");
+    }
+
+    if (cacheSize == 0) {
+        throw std::domain_error("Posterior index cache size must be positive");
+    }
+
+    size_t nstates = model.transitionProb.size();
+    size_t maxtime = data.timeStateSymbol.size();
+    size_t nsegments = (maxtime + checkpointStep - 1) / checkpointStep;
+
+    // section: forward pass, the starting state is the only one before the first step
+    vector<double> forward(nstates, 0.);
+    forward[0] = 1.;
+
+    for (size_t segment = 0; segment < nsegments; ++segment) {
+        size_t first = segment * checkpointStep;
+        size_t last = std::min(first + checkpointStep, maxtime) - 1;
+        vector<vector<double> > emissionProbability =
+            CalcEmissionProbabilities(model, data, first, last);
+
+        for (size_t t = first; t <= last; ++t) {
+            forward = CalcScaledForwardStep(forward, emissionProbability[t - first], model,
+                                            transitionSources);
+
+            if (t == first) {
+                forwardCheckpoints.push_back(forward);
+            }
+        }
+    }
+
+    // section: backward pass, probability to describe empty sequence is 1.
+    vector<double> backward(nstates, 1.);
+    vector<double> nextEmission;
+
+    NormalizeProbabilities(backward);
+    backwardCheckpoints.resize(nsegments);
+
+    for (size_t segment = nsegments; segment-- > 0;) {
+        size_t first = segment * checkpointStep;
+        size_t last = std::min(first + checkpointStep, maxtime) - 1;
+        vector<vector<double> > emissionProbability =
+            CalcEmissionProbabilities(model, data, first, last);
+
+        for (size_t t = last + 1; t-- > first;) {
+            if (t + 1 < maxtime) {
+                backward = CalcScaledBackwardStep(backward, nextEmission, model, transitionTargets);
+            }
+
+            if (t == last) {
+                backwardCheckpoints[segment] = backward;
+            }
+
+            nextEmission = emissionProbability[t - first];
+        }
+    }
+}
+
+vector<double> HMM::Algorithms::PosteriorIndex::GetPosterior(size_t t)
+{
+    if (t >= data.timeStateSymbol.size()) {
+        throw std::out_of_range("Posterior query time is out of the experiment data range");
+    }
+
+    return GetSegment(t / checkpointStep)[t % checkpointStep];
+}
+
+vector<size_t> HMM::Algorithms::PosteriorIndex::GetMostProbableStates(size_t first, size_t last)
+{
+    if (first > last || last >= data.timeStateSymbol.size()) {
+        throw std::out_of_range("Posterior query window is out of the experiment data range");
+    }
+
+    vector<size_t> mostProbableStates;
+
+    for (size_t t = first; t <= last; ++t) {
+        const vector<double>& posterior = GetSegment(t / checkpointStep)[t % checkpointStep];
+
+        mostProbableStates.push_back(FindBestState(posterior, model));
+    }
+
+    return mostProbableStates;
+}
+
+const HMM::Algorithms::PosteriorIndex::SegmentPosteriors&
+HMM::Algorithms::PosteriorIndex::GetSegment(size_t segment)
+{
+    // section: move already computed segment to the front of the cache
+    auto cached = segmentToCached.find(segment);
+
+    if (cached != segmentToCached.end()) {
+        cachedSegments.splice(cachedSegments.begin(), cachedSegments, cached->second);
+        return cached->second->second;
+    }
+
+    // section: recompute alpha and beta values between the segment checkpoints
+    size_t first = segment * checkpointStep;
+    size_t last = std::min(first + checkpointStep, data.timeStateSymbol.size()) - 1;
+    vector<vector<double> > forward(last - first + 1);
+    vector<vector<double> > backward(last - first + 1);
+    vector<vector<double> > emissionProbability =
+        CalcEmissionProbabilities(model, data, first, last);
+
+    forward.front() = forwardCheckpoints[segment];
+
+    for (size_t t = first + 1; t <= last; ++t) {
+        forward[t - first] = CalcScaledForwardStep(forward[t - first - 1],
+                                                   emissionProbability[t - first], model,
+                                                   transitionSources);
+    }
+
+    backward.back() = backwardCheckpoints[segment];
+
+    for (size_t t = last; t > first; --t) {
+        backward[t - first - 1] = CalcScaledBackwardStep(backward[t - first],
+                                                         emissionProbability[t - first], model,
+                                                         transitionTargets);
+    }
+
+    // section: combine them into posteriors and put into the cache
+    SegmentPosteriors posteriors(last - first + 1);
+
+    for (size_t i = 0; i < posteriors.size(); ++i) {
+        posteriors[i].resize(forward[i].size());
+
+        for (size_t state = 0; state < forward[i].size(); ++state) {
+            posteriors[i][state] = forward[i][state] * backward[i][state];
+        }
+
+        NormalizeProbabilities(posteriors[i]);
+    }
+
+    if (cachedSegments.size() == cacheSize) {
+        segmentToCached.erase(cachedSegments.back().first);
+        cachedSegments.pop_back();
+    }
+
+    cachedSegments.emplace_front(segment, std::move(posteriors));
+    segmentToCached[segment] = cachedSegments.begin();
+
+    return cachedSegments.front().second;
+}
 //<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< end of Algorithms namespace definitions <<<<<<<<<<<<<<<<<<<<
 
 
 //>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Estimation namespace definitions >>>>>>>>>>>>>>>>>>>>>>>>>>>
 vector<size_t> HMM::Estimation::GetMostProbableStates(
-    const vector<vector<pair<double, double> > >& forwardBackwardProb)
+    const vector<vector<pair<double, double> > >& forwardBackwardProb, const Model& model)
 {
     size_t maxtime = forwardBackwardProb.size();
     vector<size_t> mostProbableStates;
 
     for (size_t t = 0; t < maxtime; ++t) {
-        size_t mostProbableState =
-            std::distance(std::begin(forwardBackwardProb[t]),
-                          std::max_element(std::begin(forwardBackwardProb[t]),
-                                           std::end(forwardBackwardProb[t]),
-                                           [](const pair<double, double>& prev,
-                                              const pair<double, double>& next)
-                                           {return (prev.first * prev.second <
-                                                    next.first * next.second);}));
-        mostProbableStates.push_back(mostProbableState);
+        vector<double> stateProb;
+
+        for (const pair<double, double>& alphaBeta : forwardBackwardProb[t]) {
+            stateProb.push_back(alphaBeta.first * alphaBeta.second);
+        }
+
+        mostProbableStates.push_back(FindBestState(stateProb, model));
     }
 
     return std::move(mostProbableStates);
@@ -399,6 +1523,11 @@ HMM::Estimation::CombineConfusionMatrix(const ExperimentData& realData,
         size_t predictedInd = predictedStates[t];
         size_t realInd      = std::get<1>(realData.timeStateSymbol[t]);
 
+        // pruned real states go to the column of the beginning state, which is never predicted
+        if (t < realData.realStatePruned.size() && realData.realStatePruned[t]) {
+            realInd = 0;
+        }
+
         ++confusionMatrix[predictedInd][realInd];
     }
 
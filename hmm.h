@@ -1,7 +1,10 @@
 #ifndef HMM_H
 #define HMM_H
 
+#include <list>
 #include <map>
+#include <set>
+#include <string>
 #include <tuple>
 #include <utility>
 #include <vector>
@@ -16,6 +19,21 @@ namespace HMM
 {
     namespace Data
     {
+        /**
+         * \brief Represents one component of the gaussian mixture with diagonal covariance
+         */
+        struct GaussianComponent
+        {
+            /// weight of the component inside the mixture
+            double weight;
+
+            /// element[d] is the mean of d-th observation coordinate
+            std::vector<double> mean;
+
+            /// element[d] is the variance of d-th observation coordinate, must be positive
+            std::vector<double> variance;
+        };
+
         /**
          * \brief Represents hidden markov model description
          */
@@ -32,21 +50,63 @@ namespace HMM
              */
             void ReadModel(std::istream& modelSource);
 
-            /// number of different emission symbols (first such from a..z range in ascii)
+            /**
+             * \brief Optimize already read model for the algorithms evaluation
+             *
+             * \details
+             * It removes states which can never take part in any sequence of hidden states:
+             * states with zero probabilities for all symbol emissions and states unreachable
+             * from the beginning state through the emitting ones.
+             * States unable to reach the ending state are kept, since the algorithms
+             * do not require sequences to end there, so the results stay the same.
+             * Remaining states between the beginning and the ending ones are reordered
+             * with reverse Cuthill-McKee permutation, so nonzero transitions are placed
+             * closer to the diagonal of the transition matrix.
+             * \note
+             * The beginning state stays the very first and the ending state stays the last one.
+             * Experiment data must be read after the optimization, because state indices change.
+             * Use originalStateIndex to map new state indices back to the order of the model file,
+             * the algorithms also use it to break ties between equally probable states.
+             * Names of the removed states are kept in prunedStateNames.
+             */
+            void Optimize();
+
+            /**
+             * \brief Write model description to the stream
+             *
+             * \details
+             * It writes model description according to the specification file,
+             * only nonzero transitions and emissions are written.
+             */
+            void WriteModel(std::ostream& modelDestination) const;
+
+            /// number of different emission symbols (first such from a..z range in ascii), zero for continuous model
             size_t alphabetSize; 
 
+            /// number of real-valued coordinates of each observation for continuous model, zero for discrete model
+            size_t observationDimension;
+
             /// conversion of state name string to state index
             std::map<std::string, size_t> stateNameToIndex;
 
             /// inverse conversion
             std::vector<std::string> stateIndexToName;
 
+            /// index of the state in the model description file (it differs from the current one after optimization)
+            std::vector<size_t> originalStateIndex;
+
+            /// names of the states removed by optimization
+            std::set<std::string> prunedStateNames;
+
             /// element[i][j] here is the probability of transition from state i to j
             /// very first state is the begin state, the last is the end state
             std::vector<std::vector<double> > transitionProb;
 
             /// element[i][j] here is the probability to emit symbol j from state i
             std::vector<std::vector<double> > stateSymbolProb;
+
+            /// element[i] here is the gaussian mixture of observations emitted from state i (continuous model only)
+            std::vector<std::vector<GaussianComponent> > stateMixtures;
         };
 
         /**
@@ -65,8 +125,16 @@ namespace HMM
              */
             void ReadExperimentData(const Model& model, std::istream& dataSource);
 
-            /// Data triples as (time, state, symbol_emitted)
+            /// Data triples as (time, state, symbol_emitted),
+            /// state of the triple is the beginning state if the real one has been pruned by Model::Optimize,
+            /// for continuous model symbol_emitted is unused and always zero, see observations instead
             std::vector<std::tuple<size_t, size_t, size_t> > timeStateSymbol;
+
+            /// element[i] is the real-valued observation of i-th data triple (continuous model only)
+            std::vector<std::vector<double> > observations;
+
+            /// element[i] is true if the real state of i-th data triple has been pruned by Model::Optimize
+            std::vector<bool> realStatePruned;
         };
 
         /**
@@ -80,12 +148,78 @@ namespace HMM
             size_t falseNegatives;
             double fMeasure;
         };
+
+        /**
+         * \brief Integer transition and emission counts collected from hidden state sequences
+         */
+        struct TransitionEmissionCounts
+        {
+            /// element[i][j] here is the number of transitions from state i to j
+            std::vector<std::vector<size_t> > transitionCount;
+
+            /// element[i][j] here is the number of emissions of symbol j from state i
+            std::vector<std::vector<size_t> > stateSymbolCount;
+        };
+
+        /**
+         * \brief Persistent counts for Viterbi training grouped by named batches of experiment data
+         *
+         * \details
+         * Total counts are updated at each batch addition and removal,
+         * so the model can be refreshed without decoding of all the previous data.
+         */
+        struct ViterbiTrainingCounts
+        {
+            /**
+             * \brief Read counts according to the specification file
+             *
+             * \note
+             * It is supposed that the source stream is correct and contains all necessary data.
+             * In order to catch errors make sure to enable exceptions for the stream before passing it here.
+             */
+            void ReadCounts(const Model& model, std::istream& countsSource);
+
+            /// Write counts according to the specification file
+            void WriteCounts(const Model& model, std::ostream& countsDestination) const;
+
+            /// Add counts of the new batch, previous batch with the same name is replaced
+            void AddBatch(const std::string& batchName, const TransitionEmissionCounts& counts);
+
+            /// Remove counts of the batch added before
+            void RemoveBatch(const std::string& batchName);
+
+            /// counts of each batch by its name
+            std::map<std::string, TransitionEmissionCounts> batchCounts;
+
+            /// sum of all batch counts
+            TransitionEmissionCounts totalCounts;
+        };
     };
 
     namespace Algorithms
     {
         using Data::Model;
         using Data::ExperimentData;
+        using Data::TransitionEmissionCounts;
+        using Data::ViterbiTrainingCounts;
+
+        /**
+         * \brief Calculates emission probabilities for the block of time moments first..last and all states
+         *
+         * \details
+         * For discrete model these are taken from the symbol emission probabilities.
+         * For continuous model log-likelihoods of the gaussian mixtures are calculated
+         * for the whole block at once by the kernel suitable for compiler vectorization
+         * (exp and log loops are vectorized only with -ffast-math and glibc vector math library).
+         * In order to avoid underflow they are shifted by the maximal value at each time moment
+         * before exponentiation. So emission values are scaled by a common factor of each
+         * time moment, which changes neither the most probable states nor the posterior probabilities.
+         *
+         * \returns vector result[t - first][i] with the emission probability at time t from state i
+         */
+        std::vector<std::vector<double> >
+        CalcEmissionProbabilities(const Model& model, const ExperimentData& data,
+                                  size_t first, size_t last);
 
         /**
          * \brief Finds most probable sequence of hidden states
@@ -115,6 +249,100 @@ namespace HMM
          */
         std::vector<std::vector<std::pair<double, double> > >
         CalcForwardBackwardProbabiliies(const Model& model, const ExperimentData& data);
+
+        /**
+         * \brief Counts transitions and emissions along the most probable sequences of hidden states
+         *
+         * \details
+         * Sequences are decoded with FindMostProbableStateSequence by nthreads threads in parallel.
+         * Each sequence contributes transitions from the beginning state to its first state
+         * and from its last state to the ending state, if the model allows the latter.
+         * \note
+         * Only discrete models are supported. Sequence without any hidden state sequence
+         * of nonzero probability is rejected with exception, nothing is counted then.
+         */
+        TransitionEmissionCounts
+        CountMostProbableStateSequences(const Model& model,
+                                        const std::vector<ExperimentData>& sequences,
+                                        size_t nthreads);
+
+        /**
+         * \brief Builds new model from the Viterbi training counts
+         *
+         * \details
+         * Probabilities of the given model are used as the prior: each row of them is
+         * added to the corresponding counts as priorWeight pseudo-observations before normalization,
+         * i.e. p(i, j) = (count(i, j) + priorWeight * prior(i, j)) / (count(i) + priorWeight * prior(i)),
+         * where count(i) and prior(i) are the row sums.
+         * Thus transitions and emissions possible in the given model never get zero probability
+         * because of missing counts, and rows without any counts keep the given model probabilities.
+         */
+        Model TrainModel(const Model& model, const ViterbiTrainingCounts& counts,
+                         double priorWeight = 1.);
+
+        /**
+         * \brief Answers posterior state probability queries for separate time moments
+         *
+         * \details
+         * Implementation is based on the Forward-Backward algorithm, but instead of
+         * the whole alpha-beta matrix only scaled alpha and beta values at every
+         * checkpointStep-th time moment are stored at construction.
+         * A query recomputes alpha and beta values for the segment between two checkpoints
+         * it falls into. Recently recomputed segments are kept in the LRU cache.
+         * Greater checkpointStep means less memory and slower query for a segment out of the cache.
+         * \note
+         * Model and experiment data are referenced, so they must outlive the index.
+         */
+        class PosteriorIndex
+        {
+        public:
+            /**
+             * \brief Run forward and backward passes and store checkpoints
+             *
+             * \param checkpointStep number of time moments between checkpoints, must be positive
+             * \param cacheSize maximal number of recomputed segments to keep, must be positive
+             */
+            PosteriorIndex(const Model& model, const ExperimentData& data,
+                           size_t checkpointStep, size_t cacheSize);
+
+            /**
+             * \returns vector result[i] with posterior probability of the i-th state at time t
+             */
+            std::vector<double> GetPosterior(size_t t);
+
+            /**
+             * \brief Use posterior probabilities to get the most probable state at each step of [first, last]
+             *
+             * \returns vector result[t - first] with the most probable state index at time t
+             */
+            std::vector<size_t> GetMostProbableStates(size_t first, size_t last);
+
+        private:
+            typedef std::vector<std::vector<double> > SegmentPosteriors;
+            typedef std::list<std::pair<size_t, SegmentPosteriors> > SegmentCache;
+
+            /// recompute posteriors for the segment or take them from the cache
+            const SegmentPosteriors& GetSegment(size_t segment);
+
+            const Model& model;
+            const ExperimentData& data;
+            size_t checkpointStep;
+            size_t cacheSize;
+
+            /// element[j] lists states with nonzero transitions to (from) the j-th state
+            std::vector<std::vector<size_t> > transitionSources;
+            std::vector<std::vector<size_t> > transitionTargets;
+
+            /// element[s] is the scaled alpha vector at time s * checkpointStep
+            std::vector<std::vector<double> > forwardCheckpoints;
+
+            /// element[s] is the scaled beta vector at the last time moment of the s-th segment
+            std::vector<std::vector<double> > backwardCheckpoints;
+
+            /// recently used segments go first
+            SegmentCache cachedSegments;
+            std::map<size_t, SegmentCache::iterator> segmentToCached;
+        };
     };
 
     namespace Estimation
@@ -128,9 +356,12 @@ namespace HMM
 
         /**
          * \brief Use forward-backward probabilities to get the most probable state at each step
+         *
+         * \note
+         * Ties are broken in favour of the state described first in the model file.
          */
         vector<size_t> GetMostProbableStates(
-            const vector<vector<pair<double, double> > >& forwardBackwardProb);
+            const vector<vector<pair<double, double> > >& forwardBackwardProb, const Model& model);
 
         /**
          * \note
@@ -138,6 +369,8 @@ namespace HMM
          * predicted state i when their real state is j.
          * It is used as an auxiliary data structure for calculation of various estimations
          * (true positives and etc., f-measure).
+         * Steps with real states pruned by Model::Optimize are counted in the column of
+         * the beginning state, which is never predicted, so they are counted as misses.
          */
         vector<vector<size_t> > CombineConfusionMatrix(const ExperimentData& realData,
                                                        const vector<size_t>& predictedStates, const Model& model);
@@ -1,12 +1,124 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
 
 #include "hmm.h"
 
 void showUsage(std::string programName)
 {
     std::cerr << "Usage: " << programName
-              << " path_to_model path_to_data " << std::endl;
+              << " path_to_model path_to_data [--optimize] [--posterior checkpoint_step cache_size]\n"
+              << "       " << programName
+              << " --train path_to_model path_to_counts batch_name [path_to_data ...]\n"
+              << "In training mode data files are added to the counts as the named batch,\n"
+              << "without data files the batch is removed. Updated counts are saved\n"
+              << "and the trained model is printed to the standard output.\n"
+              << "With '--posterior' predictions of the checkpointed posterior index are estimated too." << std::endl;
+}
+
+/**
+ * \brief Run Viterbi training, update counts file and print the trained model
+ */
+int runTraining(int argc, char* argv[])
+{
+    // section: prepare input streams and read model, counts and data
+    HMM::Data::Model model;
+    HMM::Data::ViterbiTrainingCounts counts;
+    std::vector<HMM::Data::ExperimentData> sequences;
+    std::string countsPath = argv[3];
+    std::string batchName = argv[4];
+    std::ios_base::iostate ioExcept = (std::ifstream::failbit |
+                                       std::ifstream::badbit  |
+                                       std::ifstream::eofbit);
+
+    try
+    {
+        std::ifstream modelSource(argv[2]);
+        modelSource.exceptions(ioExcept);
+        model.ReadModel(modelSource);
+
+        // counts file is created by the first training, any other open failure is an error
+        errno = 0;
+        std::ifstream countsSource(countsPath);
+
+        if (countsSource.good()) {
+            countsSource.exceptions(ioExcept);
+            counts.ReadCounts(model, countsSource);
+        } else if (errno != ENOENT) {
+            throw std::runtime_error("Failed to open existing counts file '" + countsPath + "'");
+        }
+
+        for (int i = 5; i < argc; ++i) {
+            std::ifstream dataSource(argv[i]);
+            dataSource.exceptions(ioExcept);
+            sequences.emplace_back();
+            sequences.back().ReadExperimentData(model, dataSource);
+        }
+    } catch(std::exception& e) {
+        std::cerr << "ERROR: fatal problem while reading training input. Details: '" << e.what()
+                  << "'" << std::endl;
+        return -1;
+    }
+
+    // section: update counts and save them
+    try
+    {
+        if (sequences.empty()) {
+            counts.RemoveBatch(batchName);
+        } else {
+            size_t nthreads = std::max(1U, std::thread::hardware_concurrency());
+            counts.AddBatch(batchName,
+                            HMM::Algorithms::CountMostProbableStateSequences(model, sequences,
+                                                                             nthreads));
+        }
+    } catch(std::exception& e) {
+        std::cerr << "ERROR: fatal problem while updating counts. Details: '" << e.what()
+                  << "'" << std::endl;
+        return -1;
+    }
+
+    // write to the temporary file first, so a failure never damages previous counts
+    std::string tmpCountsPath = countsPath + ".tmp";
+    std::ofstream countsDestination(tmpCountsPath);
+    counts.WriteCounts(model, countsDestination);
+    countsDestination.close();
+
+    if (! countsDestination.good() ||
+        std::rename(tmpCountsPath.c_str(), countsPath.c_str()) != 0) {
+        std::remove(tmpCountsPath.c_str());
+        std::cerr << "ERROR: Failed to write counts file properly." << std::endl;
+        return -1;
+    }
+
+    // section: print trained model
+    HMM::Algorithms::TrainModel(model, counts).WriteModel(std::cout);
+
+    return 0;
+}
+
+/**
+ * \brief Get indices of states (except begin and end) in the order of the model description file
+ *
+ * \note
+ * It keeps the output order the same for optimized models with reordered states.
+ */
+std::vector<size_t> getPrintOrder(const HMM::Data::Model& model)
+{
+    std::vector<size_t> order(model.stateIndexToName.size() - 2);
+
+    std::iota(order.begin(), order.end(), 1);
+    std::sort(order.begin(), order.end(),
+              [&model](size_t lhs, size_t rhs)
+              {return model.originalStateIndex[lhs] < model.originalStateIndex[rhs];});
+
+    return order;
 }
 
 void printPredictionEstimation(size_t stateInd,
@@ -25,11 +137,46 @@ void printPredictionEstimation(size_t stateInd,
 int main(int argc, char* argv[])
 {
     // section: check arguments and prepare input streams
+    if (argc >= 2 && std::strcmp(argv[1], "--train") == 0) {
+        if (argc < 5) {
+            showUsage(argv[0]);
+            return -1;
+        }
+
+        return runTraining(argc, argv);
+    }
+
     if (argc < 3) {
         showUsage(argv[0]);
         return -1;
     }
 
+    bool optimizeModel = false;
+    bool queryPosteriorIndex = false;
+    size_t checkpointStep = 0;
+    size_t cacheSize = 0;
+
+    for (int i = 3; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--optimize") == 0) {
+            optimizeModel = true;
+        } else if (std::strcmp(argv[i], "--posterior") == 0 && i + 2 < argc) {
+            try
+            {
+                checkpointStep = std::stoul(argv[i + 1]);
+                cacheSize = std::stoul(argv[i + 2]);
+            } catch(std::logic_error&) {
+                showUsage(argv[0]);
+                return -1;
+            }
+
+            queryPosteriorIndex = true;
+            i += 2;
+        } else {
+            showUsage(argv[0]);
+            return -1;
+        }
+    }
+
     std::ifstream modelSource(argv[1]);
     std::ifstream dataSource(argv[2]);
 
@@ -57,6 +204,10 @@ int main(int argc, char* argv[])
     try
     {
         model.ReadModel(modelSource);
+
+        if (optimizeModel) {
+            model.Optimize();
+        }
     } catch(std::exception& e) {
         std::cerr << "ERROR: fatal problem while reading model. Details: '" << e.what()
                   << "'" << std::endl;
@@ -89,7 +240,7 @@ int main(int argc, char* argv[])
     std::cout << "Viterbi algorithm state prediction estimations:\n";
 
     // skip first and last states (begin and end)
-    for (size_t i = 1; i + 1 < estimations.size(); ++i) {
+    for (size_t i : getPrintOrder(model)) {
         printPredictionEstimation(i, estimations[i], model);
     }
 
@@ -99,18 +250,66 @@ int main(int argc, char* argv[])
     std::vector<std::vector<std::pair<double, double> > > forwardBackwardProb =
         HMM::Algorithms::CalcForwardBackwardProbabiliies(model, data);
     std::vector<size_t> mostProbableStates =
-        HMM::Estimation::GetMostProbableStates(forwardBackwardProb);
+        HMM::Estimation::GetMostProbableStates(forwardBackwardProb, model);
     confusionMatrix = HMM::Estimation::CombineConfusionMatrix(data, mostProbableStates, model);
     estimations = HMM::Estimation::GetStatePredictionEstimations(confusionMatrix);
 
     std::cout << "Forward-backward algorithm state prediction estimations:\n";
 
     // skip first and last states (begin and end)
-    for (size_t i = 1; i + 1 < estimations.size(); ++i) {
+    for (size_t i : getPrintOrder(model)) {
         printPredictionEstimation(i, estimations[i], model);
     }
 
     std::cout << "\n";
 
+    // section: run and estimate checkpointed posterior index predictions
+    if (! queryPosteriorIndex) {
+        return 0;
+    }
+
+    double maxPosteriorDifference = 0;
+
+    try
+    {
+        HMM::Algorithms::PosteriorIndex posteriorIndex(model, data, checkpointStep, cacheSize);
+
+        mostProbableStates = posteriorIndex.GetMostProbableStates(0, forwardBackwardProb.size() - 1);
+
+        // compare with the posteriors obtained from the whole forward-backward matrix
+        for (size_t t = 0; t < forwardBackwardProb.size(); ++t) {
+            std::vector<double> posterior = posteriorIndex.GetPosterior(t);
+            double total = 0;
+
+            for (const std::pair<double, double>& alphaBeta : forwardBackwardProb[t]) {
+                total += alphaBeta.first * alphaBeta.second;
+            }
+
+            for (size_t i = 0; i < posterior.size() && total > 0; ++i) {
+                double fullPosterior = (forwardBackwardProb[t][i].first *
+                                        forwardBackwardProb[t][i].second / total);
+                maxPosteriorDifference = std::max(maxPosteriorDifference,
+                                                  std::abs(fullPosterior - posterior[i]));
+            }
+        }
+    } catch(std::exception& e) {
+        std::cerr << "ERROR: fatal problem while querying posterior index. Details: '" << e.what()
+                  << "'" << std::endl;
+        return -1;
+    }
+
+    confusionMatrix = HMM::Estimation::CombineConfusionMatrix(data, mostProbableStates, model);
+    estimations = HMM::Estimation::GetStatePredictionEstimations(confusionMatrix);
+
+    std::cout << "Posterior index (checkpoint step " << checkpointStep << ", cache size "
+              << cacheSize << ") state prediction estimations:\n";
+
+    // skip first and last states (begin and end)
+    for (size_t i : getPrintOrder(model)) {
+        printPredictionEstimation(i, estimations[i], model);
+    }
+
+    std::cout << "Maximal difference from forward-backward posteriors=" << maxPosteriorDifference << "\n\n";
+
     return 0;
 }
@@ -5,8 +5,14 @@
      there must be no transitions to the starting state and from the ending state;
      there must be at least two states: begin and end)
 >
-<number of different possible symbols (a..z, no more than 26)>
+<number of different possible symbols (a..z, no more than 26)
+    or "continuous <number of observation coordinates>" for real-valued observations
+>
 <number of transitions>
 <state transitions as space delimited one-per-line triples "from to probability"; unmentioned will have zero probability>
 <number of state-symbol emission probablities>
-<state-symbol emission probabilities as space delimited one-per-line triples "state symbol probability"; unmentioned will have zero probability>
+<state-symbol emission probabilities as space delimited one-per-line triples "state symbol probability"; unmentioned will have zero probability;
+    for continuous model these are gaussian mixture components with diagonal covariance as space delimited one-per-line
+    "state weight mean_1 .. mean_N variance_1 .. variance_N", where N is the number of observation coordinates
+    and all variances are positive; state without components emits nothing
+>